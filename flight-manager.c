@@ -2,17 +2,27 @@
  * Assignment #3: Strings, structs, pointers, command-line arguments.
  **/
 
+#define _DEFAULT_SOURCE   // MAP_ANONYMOUS under -std=c11
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 
 // Limit constants
 #define MAX_CITY_NAME_LEN 20
 #define MAX_FLIGHTS_PER_CITY 5
 #define MAX_DEFAULT_SCHEDULES 50
+#define FLIGHT_CAPACITY_MAX UINT16_MAX
+
+// Pool constants
+#define CACHE_LINE_SIZE 64
+#define SCHEDULE_CHUNK_LEN 31   // schedules per pool chunk; fills a 4 KiB page
 
 // Time definitions
 #define TIME_MIN 0
@@ -23,19 +33,36 @@
 /******************************************************************************
  * Structure and Type definitions                                             *
  ******************************************************************************/
-typedef int time_t;                        // integers used for time values
+typedef int flight_time_t;                 // integers used for time values
 typedef char city_t[MAX_CITY_NAME_LEN+1];; // null terminate fixed length city
  
 // Structure to hold all the information for a single flight
-//   A city's schedule has an array of these
+//   A city's schedule has an array of these.  Times need 11 bits (plus
+//   the -1 empty marker) and seat counts are capped at FLIGHT_CAPACITY_MAX,
+//   so 16 bits per field is enough and a record is only 6 bytes.
 struct flight {
-  time_t time;       // departure time of the flight
-  int available;  // number of seats currently available on the flight
-  int capacity;   // maximum seat capacity of the flight
+  int16_t time;        // departure time of the flight
+  uint16_t available;  // number of seats currently available on the flight
+  uint16_t capacity;   // maximum seat capacity of the flight
+};
+
+// The flight data of a schedule, kept apart from the lookup data in
+// struct flight_schedule and aligned so that all of a city's flights sit
+// together in their own cache line.  It is only read once
+// flight_schedule_find has located the city.
+struct flight_table {
+  _Alignas(CACHE_LINE_SIZE) struct flight flights[MAX_FLIGHTS_PER_CITY];
 };
 
+_Static_assert(sizeof(struct flight_table) <= 2 * CACHE_LINE_SIZE,
+               "a city's flights should fit in one or two cache lines");
+
+struct flight_schedule_chunk;
+
 // Structure for an individual flight schedule
-// The main data structure of the program is an Array of these structures
+// This holds the lookup data that flight_schedule_find walks for every
+// command (name and list links), padded to one cache line per schedule;
+// its flights live in a separate flight_table of the same pool chunk.
 // Each structure will be placed on one of two linked lists:
 //                free or active
 // Initially the active list will be empty and all the schedules
@@ -43,10 +70,28 @@ struct flight {
 // free schedule on the free list, removing it from the free list,
 // setting its destination city and putting it on the active list
 struct flight_schedule {
-  city_t destination;                          // destination city name
-  struct flight flights[MAX_FLIGHTS_PER_CITY]; // array of flights to the city
-  struct flight_schedule *next;                // link list next pointer
-  struct flight_schedule *prev;                // link list prev pointer
+  _Alignas(CACHE_LINE_SIZE) city_t destination; // destination city name
+  struct flight_schedule *next;         // link list next pointer
+  struct flight_schedule *prev;         // link list prev pointer
+  struct flight *flights;               // this schedule's flight_table
+  struct flight_schedule_chunk *chunk;  // pool chunk holding this schedule
+};
+
+_Static_assert(sizeof(struct flight_schedule) == CACHE_LINE_SIZE,
+               "a schedule's lookup data should fill exactly one cache line");
+
+// Schedules are handed out from chunks of SCHEDULE_CHUNK_LEN slots, each
+// mapped with mmap and sized to a whole number of pages.  A chunk is mapped
+// when the free list runs dry and unmapped once every schedule in it has
+// been removed (bar one spare), so resident memory follows the number of
+// live schedules rather than the configured maximum.
+struct flight_schedule_chunk {
+  struct flight_table tables[SCHEDULE_CHUNK_LEN];      // flight data
+  struct flight_schedule schedules[SCHEDULE_CHUNK_LEN]; // lookup data
+  struct flight_schedule_chunk *next;  // link list of all chunks
+  struct flight_schedule_chunk *prev;
+  int len;                             // slots in use from this chunk
+  int live;                            // schedules on the active list
 };
 
 /******************************************************************************
@@ -57,18 +102,31 @@ struct flight_schedule {
 struct flight_schedule *flight_schedules_free = NULL;
 struct flight_schedule *flight_schedules_active = NULL;
 
+// All pool chunks, how many schedule slots they provide in total, the
+// most slots we may ever create, and how many chunks are currently empty.
+// One empty chunk is kept around so that alternating A/R commands do not
+// map and unmap a chunk every time.
+struct flight_schedule_chunk *flight_schedule_chunks = NULL;
+long flight_schedule_pool_size = 0;
+long flight_schedule_pool_limit = 0;
+int flight_schedule_chunks_empty = 0;
+
 
 /******************************************************************************
  * Function Prototypes                                                        *
  ******************************************************************************/
 // Misc utility io functions
 int city_read(city_t city);           
-bool time_get(time_t *time_ptr);      
+bool time_get(flight_time_t *time_ptr);      
 bool flight_capacity_get(int *capacity_ptr);
 void print_command_help(void);
 
 // Core functions of the program
-void flight_schedule_initialize(struct flight_schedule array[], int n);
+void flight_schedule_initialize(long n);
+size_t flight_schedule_chunk_bytes(void);
+bool flight_schedule_pool_grow(void);
+void flight_schedule_pool_release(struct flight_schedule_chunk *chunk);
+void flight_schedule_pool_destroy(void);
 struct flight_schedule * flight_schedule_find(city_t city);
 struct flight_schedule * flight_schedule_allocate(void);
 void flight_schedule_free(struct flight_schedule *fs);
@@ -97,17 +155,15 @@ int main(int argc, char *argv[])
     // of schedule we will support
     char *end;
     n = strtol(argv[1], &end, 10); // CPAMA p 787
-    if (n==0) {
+    if (n<=0) {
       printf("ERROR: Bad number of default max scedules specified.\n");
       exit(EXIT_FAILURE);
     }
   }
 
-  struct flight_schedule flight_schedules[n];
- 
-  // Initialize our global lists of free and active schedules using
-  // the elements of the flight_schedules array
-  flight_schedule_initialize(flight_schedules, n);
+  // Initialize our global lists of free and active schedules and the
+  // pool that backs them
+  flight_schedule_initialize(n);
 
   assert(flight_schedules_free != NULL && flight_schedules_active == NULL);
 
@@ -171,6 +227,7 @@ int main(int argc, char *argv[])
     }
   }
  done:
+  flight_schedule_pool_destroy();
   return EXIT_SUCCESS;
 }
 
@@ -287,43 +344,124 @@ void flight_schedule_reset(struct flight_schedule *fs) {
 }
 
 /******************************************************************
-* Initializes the flight_schedule array that will hold any flight *
-* schedules created by the user. This is called in main for you.  *
+* Initializes the free and active lists and the chunk pool that   *
+* will hold up to n flight schedules created by the user. This is *
+* called in main for you.                                         *
  *****************************************************************/
 
-void flight_schedule_initialize(struct flight_schedule array[], int n)
+void flight_schedule_initialize(long n)
 {
   flight_schedules_active = NULL;
   flight_schedules_free = NULL;
+  flight_schedule_chunks = NULL;
+  flight_schedule_pool_size = 0;
+  flight_schedule_pool_limit = n;
+  flight_schedule_chunks_empty = 0;
+
+  // Carve out the first chunk up front so that the free list starts
+  // out non-empty
+  flight_schedule_pool_grow();
+}
 
-  // takes care of empty array case
-  if (n==0) return;
+// This helper function returns the size of the mapping backing a pool
+// chunk: the chunk rounded up to a whole number of pages.
+size_t flight_schedule_chunk_bytes(void) {
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  size_t bytes = sizeof(struct flight_schedule_chunk);
+  return (bytes + page - 1) / page * page;
+}
 
-  // Loop through the Array connecting them
-  // as a linear doubly linked list
-  if (n == 1) {
-    flight_schedule_reset(&array[0]);
-    array[0].next = NULL;
-    array[0].prev = NULL;
-    flight_schedules_free = &array[0];
-    return;
+// This helper function maps a new pool chunk, as long as we have not
+// reached the maximum number of schedules, and puts its schedules on the
+// free list in order. Returns false if no chunk could be added.
+bool flight_schedule_pool_grow(void) {
+  if (flight_schedule_pool_size >= flight_schedule_pool_limit) {
+    return false;
+  }
+
+  struct flight_schedule_chunk *chunk =
+    mmap(NULL, flight_schedule_chunk_bytes(), PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED) {
+    return false;
+  }
+
+  chunk->len = SCHEDULE_CHUNK_LEN;
+  if (flight_schedule_pool_limit - flight_schedule_pool_size < chunk->len) {
+    chunk->len = flight_schedule_pool_limit - flight_schedule_pool_size;
+  }
+  chunk->live = 0;
+
+  chunk->prev = NULL;
+  chunk->next = flight_schedule_chunks;
+  if (flight_schedule_chunks != NULL) {
+    flight_schedule_chunks->prev = chunk;
+  }
+  flight_schedule_chunks = chunk;
+
+  // Push the slots from last to first so the free list hands them out
+  // in array order
+  for (int i = chunk->len-1; i >= 0; i--) {
+    struct flight_schedule *fs = &chunk->schedules[i];
+    fs->flights = chunk->tables[i].flights;
+    fs->chunk = chunk;
+    flight_schedule_reset(fs);
+    fs->next = flight_schedules_free;
+    if (flight_schedules_free != NULL) {
+      flight_schedules_free->prev = fs;
+    }
+    flight_schedules_free = fs;
   }
 
-  flight_schedule_reset(&array[0]);
-  array[0].next = &array[1];
-  array[0].prev = NULL;
+  flight_schedule_pool_size += chunk->len;
+  flight_schedule_chunks_empty++;
+  return true;
+}
+
+// This helper function unmaps an empty chunk, returning its pages to the
+// OS. Every
+// schedule in it is on the free list, so they are unlinked from there first.
+void flight_schedule_pool_release(struct flight_schedule_chunk *chunk) {
+  assert(chunk->live == 0);
+
+  for (int i = 0; i < chunk->len; i++) {
+    struct flight_schedule *fs = &chunk->schedules[i];
+    if (fs->prev == NULL) {
+      flight_schedules_free = fs->next;
+    } else {
+      fs->prev->next = fs->next;
+    }
+    if (fs->next != NULL) {
+      fs->next->prev = fs->prev;
+    }
+  }
 
-  for (int i=1; i<n-1; i++) {
-    flight_schedule_reset(&array[i]);
-    array[i].next = &array[i+1];
-    array[i].prev = &array[i-1];
+  if (chunk->prev == NULL) {
+    flight_schedule_chunks = chunk->next;
+  } else {
+    chunk->prev->next = chunk->next;
+  }
+  if (chunk->next != NULL) {
+    chunk->next->prev = chunk->prev;
   }
 
-  // Takes care of last node.  
-  flight_schedule_reset(&array[n-1]); // reset clears all fields
-  array[n-1].next = NULL;
-  array[n-1].prev = &array[n-2];
-  flight_schedules_free = &array[0];
+  flight_schedule_pool_size -= chunk->len;
+  flight_schedule_chunks_empty--;
+  munmap(chunk, flight_schedule_chunk_bytes());
+}
+
+// This function unmaps every pool chunk on exit, whether or not it still
+// holds active schedules.
+void flight_schedule_pool_destroy(void) {
+  while (flight_schedule_chunks != NULL) {
+    struct flight_schedule_chunk *next = flight_schedule_chunks->next;
+    munmap(flight_schedule_chunks, flight_schedule_chunk_bytes());
+    flight_schedule_chunks = next;
+  }
+  flight_schedules_active = NULL;
+  flight_schedules_free = NULL;
+  flight_schedule_pool_size = 0;
+  flight_schedule_chunks_empty = 0;
 }
 
 /***********************************************************
@@ -348,12 +486,16 @@ bool time_get(int *time_ptr) {
 /***********************************************************
  * flight_capacity_get: read the capacity of a flight from the user
    This function should read in a capacity value and check its 
-   validity.  If it is not greater than 0, it should print 
+   validity.  If it is not in 1-FLIGHT_CAPACITY_MAX, it should print 
    "Invalid capacity value" and return false. Othewise it should 
    return the value in the integer pointed to by cap_ptr.
  ***********************************************************/
 bool flight_capacity_get(int *cap_ptr) {
   if (scanf("%d", cap_ptr)==1) {
+    if (*cap_ptr > FLIGHT_CAPACITY_MAX) {
+      msg_capacity_bad();
+      return false;
+    }
     return *cap_ptr > 0;
   }
   msg_capacity_bad();
@@ -376,11 +518,14 @@ int flight_compare_time(const void *a, const void *b)
 
 // This helper function takes a blank flight_schedule off the free list and onto the active list. Used in flight_schedule_add.
 struct flight_schedule *flight_schedule_allocate(void) {
-  struct flight_schedule *move = flight_schedules_free;
-  if (move == NULL) {
+  if (flight_schedules_free == NULL && !flight_schedule_pool_grow()) {
     msg_schedule_no_free();
     return NULL;
   }
+  struct flight_schedule *move = flight_schedules_free;
+  if (move->chunk->live++ == 0) {
+    flight_schedule_chunks_empty--;
+  }
 
   if (move->next == NULL) {
     flight_schedules_free = NULL;
@@ -402,8 +547,9 @@ struct flight_schedule *flight_schedule_allocate(void) {
   return move;
   } 
 
-// This helper function takes the flight schedule of the city passed into remove and removes it from the active list, resets it, and puts it back onto the free list. Used in flight_schedule_remove.
+// This helper function takes the flight schedule of the city passed into remove and removes it from the active list, resets it, and puts it back onto the free list. If that leaves its chunk empty and we already have a spare empty chunk, the chunk is unmapped. Used in flight_schedule_remove.
 void flight_schedule_free(struct flight_schedule *fs) {
+  struct flight_schedule_chunk *chunk = fs->chunk;
   if (fs->prev == NULL) {
     if (fs->next == NULL) {
       flight_schedules_active = NULL;
@@ -445,6 +591,10 @@ void flight_schedule_free(struct flight_schedule *fs) {
         flight_schedules_free = fs;
     }
   }
+
+  if (--chunk->live == 0 && ++flight_schedule_chunks_empty > 1) {
+    flight_schedule_pool_release(chunk);
+  }
 }
 
 // This function is used extensivelky throughout the program as it finds and returns a pointer to the flight schedule of a specific city. Returns NULL if a schedule for that city doesn't exist
@@ -464,7 +614,7 @@ struct flight_schedule *flight_schedule_find(city_t city) {
 
 // This is the main fucntion that adds a flight schedule for a specifc city to the active list.
 void flight_schedule_add(city_t city) {
-  if (flight_schedules_free == NULL) {
+  if (flight_schedules_free == NULL && !flight_schedule_pool_grow()) {
     msg_schedule_no_free();
     return;
   } 
@@ -539,7 +689,7 @@ void flight_schedule_add_flight(city_t city) {
     return;
   }
   
-  time_t time; 
+  flight_time_t time; 
   int capacity;
   if (time_get(&time) == false || flight_capacity_get(&capacity) == false) {
     return;
@@ -569,7 +719,7 @@ void flight_schedule_remove_flight(city_t city) {
     return;
   } 
   
-  time_t time;
+  flight_time_t time;
   int i = 0;
   if (time_get(&time) == false) {
     return;
@@ -590,7 +740,7 @@ void flight_schedule_remove_flight(city_t city) {
 
 // This function finds the flight schedule of city, if it exists, and then finds the flight with a specifc time or the next flight after it, and schedules a seat on that flight if there are any available
 void flight_schedule_schedule_seat(city_t city) {
-  time_t time; 
+  flight_time_t time; 
   int i = 0;
   if (time_get(&time) == false) {
     return;
@@ -620,7 +770,7 @@ void flight_schedule_schedule_seat(city_t city) {
 
 // This function finds the flight schedule of city, if it exists, and then finds the flight with a specifc time, and unschedules a seat on that flight by increasing the available count if it is not empty
 void flight_schedule_unschedule_seat(city_t city) {
-  time_t time;
+  flight_time_t time;
   int i = 0;
   if (time_get(&time) == false) {
     return;